@@ -1,81 +1,156 @@
 #include <GL/glew.h>
 #include <GL/freeglut.h>
+#ifndef _WIN32
+#include <EGL/egl.h> // headless mode, see initHeadlessContext
+#include <EGL/eglext.h>
+#endif
 
 #include <cmath>
 #include <cstdlib>
 #include <vector>
+#include <algorithm>
+#include <chrono> // input latency timestamps
+#include <thread> // needs C++11 threads: MinGW-w64 with posix threads (see .vscode/tasks.json) or MSVC
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <string.h> // strcmp and strstr
 #include <ctime> // for random snowflakes
 #include <stdio.h> // fprintf and stderr
 
 using std::vector;
 using std::abs;
 
+// Size of the game world in layout units; the window itself can be any size
 const int windowWidth = 800;
 const int windowHeight = 600;
-GLuint circleVBO, circleVAO;
-const int numSegments = 50;
-GLuint shaderProgram;
+GLuint circleVBO, circleInstanceVBO, circleVAO;
+GLuint shaderProgram, circleProgram;
+GLint modelLocation, colorLocation;
+
+// Each render layer records its draw work into a CPU-side command list on a
+// worker thread; only the GL thread turns the lists into GL calls.
+enum MeshId {
+    MESH_RECT,
+    MESH_CIRCLE,
+    MESH_TRIANGLE,
+    MESH_HOOK_BODY,
+    MESH_BACKGROUND,
+    MESH_GROUND,
+    MESH_TEXT, // bitmap text, drawn with the fixed-function pipeline
+    MESH_COUNT
+};
+
+struct DrawCommand {
+    MeshId mesh;
+    float x, y;           // translation
+    float scaleX, scaleY;
+    float r, g, b;
+    const char* text;     // MESH_TEXT only
+};
+
+typedef vector<DrawCommand> CommandList;
+
+// The command list the draw* functions on this thread append to
+thread_local CommandList* activeCommandList = nullptr;
+
+void recordCommand(MeshId mesh, float x, float y, float scaleX, float scaleY, float r, float g, float b, const char* text = nullptr) {
+    activeCommandList->push_back({ mesh, x, y, scaleX, scaleY, r, g, b, text });
+}
+
+struct Mesh {
+    GLuint vao;
+    GLenum mode;
+    GLsizei count;
+};
+
+Mesh meshes[MESH_COUNT];
+
+void initPositionVBO(const vector<float>& vertices, GLuint& vbo, GLuint& vao) {
+    glGenBuffers(1, &vbo);
+    glGenVertexArrays(1, &vao);
+
+    glBindVertexArray(vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+
+    // Vertex attribute for position (x, y, z)
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+// Circles are drawn as quads whose fragment shader evaluates the circle's
+// signed distance, which gives anti-aliased edges at any radius. All circles
+// of a frame are blended, so they share one instanced draw.
+const float circleEdgePadding = 1.0f; // pixels outside the radius for the anti-aliased edge
+GLint circleViewportSizeLocation;
+const int circleInstanceFloats = 7; // center x, y, depth, radius, color r, g, b
+vector<float> circleInstances;
 
 void initCircleVBO() {
-    // Prepare vertices for a circle (center + segments)
-    vector<float> circleVertices;
-    circleVertices.push_back(0.0f); // center x
-    circleVertices.push_back(0.0f); // center y
-    circleVertices.push_back(0.0f); // center z
-    circleVertices.push_back(1.0f); // Color R
-    circleVertices.push_back(1.0f); // Color G
-    circleVertices.push_back(1.0f); // Color B
-
-    for (int i = 0; i <= numSegments; i++) {
-        float angle = i * 2.0f * M_PI / numSegments;
-        float x = cos(angle);
-        float y = sin(angle);
-        circleVertices.push_back(x); // vertex x
-        circleVertices.push_back(y); // vertex y
-        circleVertices.push_back(0.0f); // vertex z
-        circleVertices.push_back(1.0f); // Color R
-        circleVertices.push_back(1.0f); // Color G
-        circleVertices.push_back(1.0f); // Color B
-    }
+    // Unit quad as a triangle strip, expanded to each instance's radius in the vertex shader
+    vector<float> quadVertices = {
+        -1.0f, -1.0f,
+        1.0f, -1.0f,
+        -1.0f, 1.0f,
+        1.0f, 1.0f
+    };
 
-    // Generate VBO and VAO
+    // Generate VBOs and VAO
     glGenBuffers(1, &circleVBO);
+    glGenBuffers(1, &circleInstanceVBO);
     glGenVertexArrays(1, &circleVAO);
 
     glBindVertexArray(circleVAO);
 
     glBindBuffer(GL_ARRAY_BUFFER, circleVBO);
-    glBufferData(GL_ARRAY_BUFFER, circleVertices.size() * sizeof(float), circleVertices.data(), GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, quadVertices.size() * sizeof(float), quadVertices.data(), GL_STATIC_DRAW);
 
-    // Vertex attribute for position (x, y, z)
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
+    // Vertex attribute for the quad corner (x, y)
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
     glEnableVertexAttribArray(0);
 
-    // Vertex attribute for color (r, g, b)
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+    glBindBuffer(GL_ARRAY_BUFFER, circleInstanceVBO);
+
+    // Per-instance attributes for center (x, y, depth), radius and color (r, g, b)
+    GLsizei stride = circleInstanceFloats * sizeof(float);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride, (void*)(4 * sizeof(float)));
+    for (int attribute = 1; attribute <= 3; ++attribute) {
+        glEnableVertexAttribArray(attribute);
+        glVertexAttribDivisor(attribute, 1);
+    }
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
 }
 
-void drawCircle(float cx, float cy, float r, int segments = 12, float rColor = 1.0f, float gColor = 1.0f, float bColor = 1.0f) {
-    glBindVertexArray(circleVAO);
-    glUseProgram(shaderProgram); // Use the shader program
-    glUniform3f(glGetUniformLocation(shaderProgram, "color"), rColor, gColor, bColor); // Set color uniform
+void drawCircle(float cx, float cy, float r, float rColor = 1.0f, float gColor = 1.0f, float bColor = 1.0f) {
+    recordCommand(MESH_CIRCLE, cx, cy, r, r, rColor, gColor, bColor);
+}
 
-    float model[16] = {
-        r, 0.0f, 0.0f, 0.0f,
-        0.0f, r, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-        cx, cy, 0.0f, 1.0f
-    };
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, model);
+// sceneWidth x sceneHeight is the viewport in pixels, used to size the edge padding
+void submitCircles(int sceneWidth, int sceneHeight) {
+    if (circleInstances.empty()) {
+        return;
+    }
 
-    glDrawArrays(GL_TRIANGLE_FAN, 0, numSegments + 2); // Draw the circle
+    glUseProgram(circleProgram);
+    glUniform2f(circleViewportSizeLocation, (float)sceneWidth, (float)sceneHeight);
 
-    glBindVertexArray(0);
-    glUseProgram(0); // Unbind the shader program
+    glBindBuffer(GL_ARRAY_BUFFER, circleInstanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, circleInstances.size() * sizeof(float), circleInstances.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindVertexArray(circleVAO);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, circleInstances.size() / circleInstanceFloats);
+
+    circleInstances.clear();
 }
 
 GLuint rectVBO, rectVAO;
@@ -111,22 +186,7 @@ void initRectangleVBO() {
 }
 
 void drawRectangle(float x, float y, float width, float height, float r, float g, float b) {
-    glBindVertexArray(rectVAO);
-    glUseProgram(shaderProgram); // Use the shader program
-    glUniform3f(glGetUniformLocation(shaderProgram, "color"), r, g, b); // Set color uniform
-
-    float model[16] = {
-        width, 0.0f, 0.0f, 0.0f,
-        0.0f, height, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-        x, y, 0.0f, 1.0f
-    };
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, model);
-
-    glDrawArrays(GL_TRIANGLE_FAN, 0, 4); // Draw the rectangle
-
-    glBindVertexArray(0);
-    glUseProgram(0); // Unbind the shader program
+    recordCommand(MESH_RECT, x, y, width, height, r, g, b);
 }
 
 void drawWindow(float x, float y, float width, float height) {
@@ -177,7 +237,6 @@ void initSnowflakes(int numSnowflakes) {
 }
 
 void drawSnowflake(float x, float y, float size) {
-    glColor3f(1.0f, 1.0f, 1.0f);
     drawCircle(x, y, size);
 }
 
@@ -191,9 +250,9 @@ void updateSnowflakes() {
     }
 }
 
-void drawSnowflakes() {
-    for (const auto& snowflake : snowflakes) {
-        drawSnowflake(snowflake.x, snowflake.y, snowflake.size);
+void drawSnowflakes(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+        drawSnowflake(snowflakes[i].x, snowflakes[i].y, snowflakes[i].size);
     }
 }
 
@@ -203,25 +262,20 @@ void drawBuilding(float x, float y, float width, float height, float r, float g,
     drawBuildingRoof(x, y, width, height, r, g, b);
 }
 
-void drawTriangle(float x, float y, float base, float height, float r, float g, float b) {
-    glUseProgram(shaderProgram); // Use the shader program
-    glUniform3f(glGetUniformLocation(shaderProgram, "color"), r, g, b); // Set color uniform
+GLuint triangleVBO, triangleVAO;
 
-    float model[16] = {
-        base, 0.0f, 0.0f, 0.0f,
-        0.0f, height, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-        x, y, 0.0f, 1.0f
+void initTriangleVBO() {
+    // Apex at the origin, base one unit below
+    vector<float> triangleVertices = {
+        0.0f, 0.0f, 0.0f,
+        -0.5f, -1.0f, 0.0f,
+        0.5f, -1.0f, 0.0f
     };
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, model);
-
-    glBegin(GL_TRIANGLES);
-    glVertex2f(0.0f, 0.0f);
-    glVertex2f(-0.5f, -1.0f);
-    glVertex2f(0.5f, -1.0f);
-    glEnd();
+    initPositionVBO(triangleVertices, triangleVBO, triangleVAO);
+}
 
-    glUseProgram(0); // Unbind the shader program
+void drawTriangle(float x, float y, float base, float height, float r, float g, float b) {
+    recordCommand(MESH_TRIANGLE, x, y, base, height, r, g, b);
 }
 
 void drawChristmasTree(float x, float y) {
@@ -239,69 +293,247 @@ void drawChristmasTree(float x, float y) {
 float clampX = 385.0f;
 float clampSpeed = 10.0f;
 
-void drawCraneHook(float x, float y) {
-    float hookWidth = 20.0f;
-    float hookHeight = 60.0f;
-    float hookCurveRadius = 15.0f;
-
-    glUseProgram(shaderProgram); // Use the shader program
-
-    // Draw the line
-    glUniform3f(glGetUniformLocation(shaderProgram, "color"), 0.3f, 0.3f, 0.3f); // Set color uniform
-    float model[16] = {
-        1.0f, 0.0f, 0.0f, 0.0f,
-        0.0f, 1.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-        clampX + hookWidth / 2, y + hookHeight + 100.0f, 0.0f, 1.0f
+const float hookWidth = 20.0f;
+const float hookHeight = 60.0f;
+const float hookCurveRadius = 15.0f;
+GLuint hookBodyVBO, hookBodyVAO;
+
+void initHookBodyVBO() {
+    // Trapezoid narrowing towards the top of the hook
+    vector<float> hookBodyVertices = {
+        0.0f, 0.0f, 0.0f,
+        hookWidth, 0.0f, 0.0f,
+        hookWidth * 0.8f, hookHeight, 0.0f,
+        hookWidth * 0.2f, hookHeight, 0.0f
     };
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, model);
-    glLineWidth(4);
-    glBegin(GL_LINES);
-    glVertex2f(0.0f, 0.0f);
-    glVertex2f(0.0f, -100.0f);
-    glEnd();
+    initPositionVBO(hookBodyVertices, hookBodyVBO, hookBodyVAO);
+}
+
+void drawCraneHook(float x, float y) {
+    // Draw the line (4 px wide, 100 px long)
+    drawRectangle(x + hookWidth / 2 - 2.0f, y + hookHeight, 4.0f, 100.0f, 0.3f, 0.3f, 0.3f);
 
     // Draw the hook body
-    glUniform3f(glGetUniformLocation(shaderProgram, "color"), 0.7f, 0.7f, 0.7f); // Set color uniform
-    model[12] = clampX;
-    model[13] = y;
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, model);
-    glBegin(GL_POLYGON);
-    glVertex2f(0.0f, 0.0f);
-    glVertex2f(hookWidth, 0.0f);
-    glVertex2f(hookWidth * 0.8f, hookHeight);
-    glVertex2f(hookWidth * 0.2f, hookHeight);
-    glEnd();
+    recordCommand(MESH_HOOK_BODY, x, y, 1.0f, 1.0f, 0.7f, 0.7f, 0.7f);
 
     // Draw the hook curve
-    glUniform3f(glGetUniformLocation(shaderProgram, "color"), 0.4f, 0.4f, 0.4f); // Set color uniform
-    model[12] = clampX + hookWidth / 2;
-    model[13] = y + hookHeight;
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, model);
-    glBegin(GL_TRIANGLE_FAN);
-    glVertex2f(0.0f, 0.0f);
-    for (int i = 0; i <= 20; ++i) {
-        float angle = i * 2.0f * M_PI / 20;
-        float xOffset = hookCurveRadius * cos(angle);
-        float yOffset = hookCurveRadius * sin(angle);
-        glVertex2f(xOffset, yOffset);
-    }
-    glEnd();
+    drawCircle(x + hookWidth / 2, y + hookHeight, hookCurveRadius, 0.4f, 0.4f, 0.4f);
 
     // Draw the hook circles
-    drawCircle(clampX + hookWidth * 0.2f, y + hookHeight * 0.7f, 3.0f, 12, 0.1f, 0.1f, 0.1f);
-    drawCircle(clampX + hookWidth * 0.8f, y + hookHeight * 0.7f, 3.0f, 12, 0.1f, 0.1f, 0.1f);
+    drawCircle(x + hookWidth * 0.2f, y + hookHeight * 0.7f, 3.0f, 0.1f, 0.1f, 0.1f);
+    drawCircle(x + hookWidth * 0.8f, y + hookHeight * 0.7f, 3.0f, 0.1f, 0.1f, 0.1f);
+}
 
-    glUseProgram(0); // Unbind the shader program
+using LatencyClock = std::chrono::steady_clock;
+
+// Power-aware throttling: the frame timer sets the redraw rate, so slowing it
+// down while nobody is watching saves CPU and GPU alike. The simulation runs
+// on elapsed time, so a lower redraw rate does not slow the game down; hidden
+// windows stop simulating entirely and pick up where they left off.
+enum PowerState {
+    POWER_ACTIVE,
+    POWER_IDLE,  // pointer outside the window or no input for idleTimeoutMs
+    POWER_HIDDEN // minimized or fully covered
+};
+
+PowerState powerState = POWER_ACTIVE;
+const int idleStepMs = 100;      // ~10 fps while idle
+const int hiddenStepMs = 250;    // timers only poll for visibility while hidden
+const int idleTimeoutMs = 60000;
+bool windowVisible = true;
+bool pointerInWindow = true;
+LatencyClock::time_point lastActivity = LatencyClock::now();
+
+void updatePowerState() {
+    int inactiveMs = std::chrono::duration_cast<std::chrono::milliseconds>(LatencyClock::now() - lastActivity).count();
+    PowerState newState = !windowVisible ? POWER_HIDDEN
+                        : (!pointerInWindow || inactiveMs >= idleTimeoutMs) ? POWER_IDLE
+                        : POWER_ACTIVE;
+    if (newState != powerState) {
+        powerState = newState;
+        if (powerState != POWER_HIDDEN) {
+            glutPostRedisplay();
+        }
+    }
+}
+
+// Interval for a timer that runs every activeMs while the game is being watched
+int timerInterval(int activeMs) {
+    if (powerState == POWER_HIDDEN) {
+        return hiddenStepMs;
+    }
+    return powerState == POWER_IDLE ? std::max(activeMs, idleStepMs) : activeMs;
+}
+
+void noteActivity() {
+    lastActivity = LatencyClock::now();
+    updatePowerState();
 }
 
-void updateClamp(int value) {
+void handleWindowStatus(int status) {
+    windowVisible = status != GLUT_HIDDEN && status != GLUT_FULLY_COVERED;
+    updatePowerState();
+}
+
+void handleEntry(int state) {
+    pointerInWindow = state == GLUT_ENTERED;
+    updatePowerState();
+}
+
+void handleMouseMotion(int x, int y) {
+    noteActivity();
+}
+
+// The simulation advances in fixed steps of simulationStepMs of elapsed time,
+// however often frames are drawn; see advanceSimulation
+const int simulationStepMs = 16;
+LatencyClock::time_point simulatedUntil = LatencyClock::now();
+
+void stepClamp() {
     clampX += clampSpeed;
     if (clampX > windowWidth - 40.0f || clampX < 0) {
         clampSpeed = -clampSpeed;
     }
-    glutPostRedisplay();
-    glutTimerFunc(16, updateClamp, 0);
+}
+
+// Late latching: instead of using the clampX left behind by the last simulation
+// step, sample the clamp position right before it is drawn by advancing it by
+// the fraction of a step that has elapsed since then.
+bool lateLatchEnabled = false;
+
+float latchClampX() {
+    float elapsedMs = std::chrono::duration<float, std::milli>(LatencyClock::now() - simulatedUntil).count();
+    float stepFraction = std::min(std::max(elapsedMs / simulationStepMs, 0.0f), 1.0f);
+    return clampX + clampSpeed * stepFraction;
+}
+
+// Input-to-photon latency: every input event is timestamped when it arrives.
+// The inputs a frame shows are tagged with a GL_TIMESTAMP query placed after
+// its swap, which records the GPU clock when the GPU actually got there. The
+// GPU time is mapped onto steady_clock with an offset sampled from
+// glGetInteger64v(GL_TIMESTAMP), so when the result is read back doesn't matter.
+struct InFlightInputs {
+    GLuint timestampQuery;
+    vector<LatencyClock::time_point> timestamps;
+};
+
+vector<LatencyClock::time_point> pendingInputs;
+std::deque<InFlightInputs> inFlightInputs;
+vector<GLuint> freeTimestampQueries;
+vector<float> inputLatenciesMs;
+const size_t latencyReportInterval = 30;
+
+void recordInput() {
+    noteActivity();
+    pendingInputs.push_back(LatencyClock::now());
+}
+
+// Call right after the swap of the frame that first shows the pending inputs
+void timestampPendingInputs() {
+    if (pendingInputs.empty()) {
+        return;
+    }
+    GLuint query;
+    if (freeTimestampQueries.empty()) {
+        glGenQueries(1, &query);
+    } else {
+        query = freeTimestampQueries.back();
+        freeTimestampQueries.pop_back();
+    }
+    glQueryCounter(query, GL_TIMESTAMP);
+    inFlightInputs.push_back({ query, std::move(pendingInputs) });
+    pendingInputs.clear();
+}
+
+// Converts a GL_TIMESTAMP value (nanoseconds on the GPU clock) to steady_clock time
+LatencyClock::time_point gpuTimeToClock(GLint64 gpuTimeNs) {
+    GLint64 gpuNowNs = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpuNowNs);
+    LatencyClock::time_point now = LatencyClock::now();
+    return now - std::chrono::duration_cast<LatencyClock::duration>(std::chrono::nanoseconds(gpuNowNs - gpuTimeNs));
+}
+
+float latencyPercentile(const vector<float>& sorted, float percentile) {
+    size_t index = (size_t)(percentile / 100.0f * (sorted.size() - 1) + 0.5f);
+    return sorted[index];
+}
+
+// Reads back finished timestamps without blocking; queries complete in order, so stop at the first pending one
+void resolveCompletedInputs() {
+    while (!inFlightInputs.empty()) {
+        InFlightInputs& frame = inFlightInputs.front();
+        GLint available = 0;
+        glGetQueryObjectiv(frame.timestampQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            break;
+        }
+        GLint64 gpuTimeNs = 0;
+        glGetQueryObjecti64v(frame.timestampQuery, GL_QUERY_RESULT, &gpuTimeNs);
+        LatencyClock::time_point shownAt = gpuTimeToClock(gpuTimeNs);
+        for (const auto& timestamp : frame.timestamps) {
+            inputLatenciesMs.push_back(std::chrono::duration<float, std::milli>(shownAt - timestamp).count());
+        }
+        freeTimestampQueries.push_back(frame.timestampQuery);
+        inFlightInputs.pop_front();
+    }
+
+    if (inputLatenciesMs.size() >= latencyReportInterval) {
+        std::sort(inputLatenciesMs.begin(), inputLatenciesMs.end());
+        printf("Input latency over %d events: p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+               (int)inputLatenciesMs.size(),
+               latencyPercentile(inputLatenciesMs, 50.0f),
+               latencyPercentile(inputLatenciesMs, 95.0f),
+               latencyPercentile(inputLatenciesMs, 99.0f),
+               inputLatenciesMs.back());
+        inputLatenciesMs.clear();
+    }
+}
+
+// Frame throttling keeps the driver from queueing several frames ahead of the
+// display, which would otherwise add whole frames of latency to every input.
+enum FrameThrottle {
+    THROTTLE_NONE,
+    THROTTLE_FINISH, // glFinish after every swap
+    THROTTLE_FENCE   // allow at most maxQueuedFrames frames in flight
+};
+
+FrameThrottle frameThrottle = THROTTLE_NONE;
+const int maxQueuedFrames = 1;
+GLsync frameFences[maxQueuedFrames] = {};
+int frameFenceIndex = 0;
+
+void releaseFrameFences() {
+    for (auto& fence : frameFences) {
+        if (fence) {
+            glDeleteSync(fence);
+            fence = 0;
+        }
+    }
+}
+
+void waitForQueuedFrames() {
+    GLsync& fence = frameFences[frameFenceIndex];
+    if (fence) {
+        glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000); // 100 ms upper bound
+        glDeleteSync(fence);
+        fence = 0;
+    }
+}
+
+void throttleSwappedFrame() {
+    if (frameThrottle == THROTTLE_FINISH) {
+        glFinish();
+    } else if (frameThrottle == THROTTLE_FENCE) {
+        frameFences[frameFenceIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        frameFenceIndex = (frameFenceIndex + 1) % maxQueuedFrames;
+    }
+}
+
+void cycleFrameThrottle() {
+    releaseFrameFences();
+    frameThrottle = (FrameThrottle)((frameThrottle + 1) % 3);
+    const char* names[] = { "off", "glFinish", "fence" };
+    printf("Frame throttle: %s\n", names[frameThrottle]);
 }
 
 struct FallingHouse {
@@ -310,18 +542,28 @@ struct FallingHouse {
 };
 
 vector<FallingHouse> fallingHouses;
+int queuedDrops = 0; // clicks waiting for the late-latched clamp position
 
 void drawHouse(float x, float y) {
     drawBuilding(x, y, 50.0f, 40.0f, 0.8f, 0.6f, 0.4f);
 }
 
+void dropHouse(float x) {
+    FallingHouse newHouse;
+    newHouse.x = x;
+    newHouse.y = 450.0f;
+    newHouse.isFalling = true;
+    fallingHouses.push_back(newHouse);
+}
+
 void mouseClick(int button, int state, int x, int y) {
     if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
-        FallingHouse newHouse;
-        newHouse.x = clampX;
-        newHouse.y = 450.0f;
-        newHouse.isFalling = true;
-        fallingHouses.push_back(newHouse);
+        recordInput();
+        if (lateLatchEnabled) {
+            queuedDrops++;
+        } else {
+            dropHouse(clampX);
+        }
     }
 }
 
@@ -329,6 +571,7 @@ float stackHeight = 100.0f;
 
 void restartGame() {
     fallingHouses.clear();
+    queuedDrops = 0;
     stackHeight = 100.0f;
     clampX = 385.0f;
     clampSpeed = 2.0f;
@@ -374,7 +617,6 @@ void updateHousePositions() {
 }
 
 void drawCloud(float x, float y, float size) {
-    glColor4f(1.0f, 1.0f, 1.0f, 0.7f);
     for (int i = 0; i < 3; ++i) {
         for (int j = 0; j < 3; ++j) {
             drawRectangle(x + i * size * 0.6f, y + j * size * 0.6f, size, size, 1.0f, 1.0f, 1.0f);
@@ -389,7 +631,6 @@ void drawModernBuilding(float x, float y, float width, float height) {
         drawRectangle(i, y, 2.0f, height, 0.4f, 0.4f, 0.4f);
     }
 
-    glColor3f(0.2f, 0.5f, 0.8f);
     int rows = height / 30;
     int cols = width / 30;
     float windowWidth = width / cols;
@@ -415,21 +656,7 @@ void initBackgroundVBO() {
         0.0f, windowHeight, 0.0f // Top-left corner
     };
 
-    // Generate VBO and VAO
-    glGenBuffers(1, &bgVBO);
-    glGenVertexArrays(1, &bgVAO);
-
-    glBindVertexArray(bgVAO);
-
-    glBindBuffer(GL_ARRAY_BUFFER, bgVBO);
-    glBufferData(GL_ARRAY_BUFFER, bgVertices.size() * sizeof(float), bgVertices.data(), GL_STATIC_DRAW);
-
-    // Vertex attribute for position (x, y, z)
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
+    initPositionVBO(bgVertices, bgVBO, bgVAO);
 }
 
 void initGroundVBO() {
@@ -441,59 +668,15 @@ void initGroundVBO() {
         0.0f, 100.0f, 0.0f // Top-left corner
     };
 
-    // Generate VBO and VAO
-    glGenBuffers(1, &groundVBO);
-    glGenVertexArrays(1, &groundVAO);
-
-    glBindVertexArray(groundVAO);
-
-    glBindBuffer(GL_ARRAY_BUFFER, groundVBO);
-    glBufferData(GL_ARRAY_BUFFER, groundVertices.size() * sizeof(float), groundVertices.data(), GL_STATIC_DRAW);
-
-    // Vertex attribute for position (x, y, z)
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
+    initPositionVBO(groundVertices, groundVBO, groundVAO);
 }
 
 void drawBackground() {
-    glBindVertexArray(bgVAO);
-    glUseProgram(shaderProgram); // Use the shader program
-    glUniform3f(glGetUniformLocation(shaderProgram, "color"), 0.7f, 0.9f, 1.0f); // Set color uniform
-
-    float model[16] = {
-        1.0f, 0.0f, 0.0f, 0.0f,
-        0.0f, 1.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-        0.0f, 0.0f, 0.0f, 1.0f
-    };
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, model);
-
-    glDrawArrays(GL_TRIANGLE_FAN, 0, 4); // Draw the background
-
-    glBindVertexArray(0);
-    glUseProgram(0); // Unbind the shader program
+    recordCommand(MESH_BACKGROUND, 0.0f, 0.0f, 1.0f, 1.0f, 0.7f, 0.9f, 1.0f);
 }
 
 void drawGround() {
-    glBindVertexArray(groundVAO);
-    glUseProgram(shaderProgram); // Use the shader program
-    glUniform3f(glGetUniformLocation(shaderProgram, "color"), 0.6f, 1.0f, 0.6f); // Set color uniform
-
-    float model[16] = {
-        1.0f, 0.0f, 0.0f, 0.0f,
-        0.0f, 1.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-        0.0f, 0.0f, 0.0f, 1.0f
-    };
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, model);
-
-    glDrawArrays(GL_TRIANGLE_FAN, 0, 4); // Draw the ground
-
-    glBindVertexArray(0);
-    glUseProgram(0); // Unbind the shader program
+    recordCommand(MESH_GROUND, 0.0f, 0.0f, 1.0f, 1.0f, 0.6f, 1.0f, 0.6f);
 }
 
 void drawStylizedSkyBackground() {
@@ -525,11 +708,6 @@ void drawPixelatedSun(float x, float y, float size) {
         {1.0f, 0.7f, 0.0f}  // Dark Orange
     };
 
-    glPushMatrix();
-    glTranslatef(x, y, 0.0f);
-    glRotatef(sunRotationAngle, 0.0f, 0.0f, 1.0f); // Rotate the sun itself
-    glTranslatef(-x, -y, 0.0f);
-
     for (int i = -6; i < 6; ++i) {
         for (int j = -6; j < 6; ++j) {
             int distance = abs(i) + abs(j);
@@ -537,20 +715,22 @@ void drawPixelatedSun(float x, float y, float size) {
             drawRectangle(x + i * pixelSize, y + j * pixelSize, pixelSize, pixelSize, colors[colorIndex][0], colors[colorIndex][1], colors[colorIndex][2]);
         }
     }
-
-    glPopMatrix();
 }
 
-void updateSunRotation(int value) {
+void stepSunRotation() {
     sunRotationAngle += 1.0f; // Decrease the rotation speed for smaller movements
     if (sunRotationAngle >= 360.0f) {
         sunRotationAngle = 0.0f;
     }
-    glutPostRedisplay();
-    glutTimerFunc(16, updateSunRotation, 0);
 }
 
-void drawText(float x, float y, const char* text) {
+void drawText(float x, float y, const char* text, float r = 0.0f, float g = 0.0f, float b = 0.0f) {
+    recordCommand(MESH_TEXT, x, y, 1.0f, 1.0f, r, g, b, text);
+}
+
+void submitText(const DrawCommand& command) {
+    const char* text = command.text;
+    glColor3f(command.r, command.g, command.b);
     glMatrixMode(GL_PROJECTION);
     glPushMatrix();
     glLoadIdentity();
@@ -559,7 +739,7 @@ void drawText(float x, float y, const char* text) {
     glPushMatrix();
     glLoadIdentity();
 
-    glRasterPos2f(x, y);
+    glRasterPos2f(command.x, command.y);
     while (*text) {
         glutBitmapCharacter(GLUT_BITMAP_HELVETICA_18, *text);
         text++;
@@ -572,16 +752,22 @@ void drawText(float x, float y, const char* text) {
 }
 
 void drawInstructions() {
-    glColor3f(0.0f, 0.0f, 0.0f); // Set text color to black
     drawText(10.0f, windowHeight - 20.0f, "Controls:");
     drawText(10.0f, windowHeight - 40.0f, "Left Click: Drop House");
     drawText(10.0f, windowHeight - 60.0f, "+: Zoom In");
     drawText(10.0f, windowHeight - 80.0f, "-: Zoom Out");
     drawText(10.0f, windowHeight - 100.0f, "Mouse Scroll: Zoom In/Out");
+    drawText(10.0f, windowHeight - 120.0f, "L: Toggle Late Latching");
+    drawText(10.0f, windowHeight - 140.0f, "T: Cycle Frame Throttle");
+    drawText(10.0f, windowHeight - 160.0f, "C: Start/Stop Capture");
+    drawText(10.0f, windowHeight - 180.0f, "R: Toggle Dynamic Resolution");
 }
 
-void display() {
-    glClear(GL_COLOR_BUFFER_BIT);
+float hookX = 385.0f; // clamp position the crane hook layer records with
+
+// Layers record the items in [begin, end) of what they draw; layers without
+// an item count are recorded whole and ignore the range.
+void recordSkyLayer(size_t begin, size_t end) {
     drawStylizedSkyBackground();
 
     // Calculate sun's new position in the top right corner
@@ -590,18 +776,31 @@ void display() {
 
     // Draw the sun
     drawPixelatedSun(sunX, sunY, 75);
+}
 
-    updateHousePositions();
+size_t houseCount() {
+    return fallingHouses.size();
+}
 
-    for (auto & house: fallingHouses) {
-        drawHouse(house.x, house.y);
+void recordHousesLayer(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+        drawHouse(fallingHouses[i].x, fallingHouses[i].y);
     }
+}
 
-    drawCraneHook(clampX, 450.0f);
+void recordCraneHookLayer(size_t begin, size_t end) {
+    drawCraneHook(hookX, 450.0f);
+}
 
-    updateSnowflakes(); // update snowflake positions
-    drawSnowflakes(); // draw snowflakes
+size_t snowflakeCount() {
+    return snowflakes.size();
+}
+
+void recordSnowLayer(size_t begin, size_t end) {
+    drawSnowflakes(begin, end); // draw snowflakes
+}
 
+void recordTreesLayer(size_t begin, size_t end) {
     drawChristmasTree(100, 100);
     drawChristmasTree(150, 100);
     drawChristmasTree(300, 100);
@@ -610,17 +809,735 @@ void display() {
     drawChristmasTree(550, 100); // draw christmas tree on the right
     drawChristmasTree(700, 100); // draw christmas tree on the right
     drawChristmasTree(750, 100); // draw christmas tree on the right
+}
 
+void recordHudLayer(size_t begin, size_t end) {
     drawInstructions(); // Draw the instructions
+}
+
+struct RenderLayer {
+    void (*record)(size_t begin, size_t end);
+    size_t (*itemCount)(); // nullptr for layers recorded as a single task
+    size_t itemsPerTask;
+    vector<CommandList> chunks; // one command list per task, in item order
+};
+
+// Recorded back to front; submitScene turns that order into depth. Houses
+// produce about 40 commands each and snowflakes one, hence the chunk sizes.
+RenderLayer renderLayers[] = {
+    { recordSkyLayer, nullptr, 0, {} },
+    { recordHousesLayer, houseCount, 32, {} },
+    { recordCraneHookLayer, nullptr, 0, {} },
+    { recordSnowLayer, snowflakeCount, 1024, {} },
+    { recordTreesLayer, nullptr, 0, {} },
+    { recordHudLayer, nullptr, 0, {} }
+};
+
+struct LayerTask {
+    RenderLayer* layer;
+    CommandList* commands;
+    size_t begin, end;
+};
+
+// Layer recording is shared between a pool of worker threads and the GL
+// thread. Workers only read game state, which the GL thread leaves untouched
+// until every task of the frame has been recorded.
+std::mutex layerMutex;
+std::condition_variable layerWorkReady, layerWorkDone;
+vector<LayerTask> layerTasks;
+size_t nextLayerTask = 0;
+size_t layerTasksRemaining = 0;
+bool layerWorkersStopping = false;
+vector<std::thread> layerWorkers;
+
+void recordLayerTask(const LayerTask& task) {
+    task.commands->clear();
+    activeCommandList = task.commands;
+    task.layer->record(task.begin, task.end);
+    activeCommandList = nullptr;
+}
+
+// Records tasks until none are left; called with layerMutex held
+void recordPendingLayerTasks(std::unique_lock<std::mutex>& lock) {
+    while (nextLayerTask < layerTasks.size()) {
+        const LayerTask& task = layerTasks[nextLayerTask++];
+        lock.unlock();
+        recordLayerTask(task);
+        lock.lock();
+        if (--layerTasksRemaining == 0) {
+            layerWorkDone.notify_all();
+        }
+    }
+}
 
+void layerWorkerLoop() {
+    std::unique_lock<std::mutex> lock(layerMutex);
+    for (;;) {
+        layerWorkReady.wait(lock, [] { return layerWorkersStopping || nextLayerTask < layerTasks.size(); });
+        if (layerWorkersStopping) {
+            return;
+        }
+        recordPendingLayerTasks(lock);
+    }
+}
+
+void initLayerWorkers() {
+    // The GL thread records tasks too, so one core is already covered
+    int numWorkers = (int)std::thread::hardware_concurrency() - 1;
+    for (int i = 0; i < numWorkers; ++i) {
+        layerWorkers.emplace_back(layerWorkerLoop);
+    }
+}
+
+void shutdownLayerWorkers() {
+    {
+        std::lock_guard<std::mutex> lock(layerMutex);
+        layerWorkersStopping = true;
+    }
+    layerWorkReady.notify_all();
+    for (auto& worker : layerWorkers) {
+        worker.join();
+    }
+    layerWorkers.clear();
+}
+
+// Splits the layers into tasks, each with its own command list
+void planLayerTasks() {
+    layerTasks.clear();
+    for (auto& layer : renderLayers) {
+        size_t items = layer.itemCount ? layer.itemCount() : 1;
+        size_t itemsPerTask = layer.itemCount ? layer.itemsPerTask : 1;
+        size_t numChunks = std::max((items + itemsPerTask - 1) / itemsPerTask, (size_t)1);
+        layer.chunks.resize(numChunks);
+        for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+            size_t begin = chunk * itemsPerTask;
+            layerTasks.push_back({ &layer, &layer.chunks[chunk], begin, std::min(begin + itemsPerTask, items) });
+        }
+    }
+}
+
+void recordRenderLayers() {
+    std::unique_lock<std::mutex> lock(layerMutex);
+    planLayerTasks();
+    nextLayerTask = 0;
+    layerTasksRemaining = layerTasks.size();
+    // Wake one worker per task beyond the one the GL thread takes, not the whole pool
+    size_t workersToWake = std::min(layerTasks.size() - 1, layerWorkers.size());
+    for (size_t i = 0; i < workersToWake; ++i) {
+        layerWorkReady.notify_one();
+    }
+    recordPendingLayerTasks(lock);
+    layerWorkDone.wait(lock, [] { return layerTasksRemaining == 0; });
+}
+
+// The layers are submitted as one back-to-front sequence, and a command's
+// position in it becomes its depth. That lets opaque geometry be drawn front
+// to back, so early depth testing rejects whatever later layers cover, while
+// still giving the same picture as painting everything in order.
+vector<const DrawCommand*> frameCommands;
+
+bool isOpaque(const DrawCommand& command) {
+    // Circles blend their anti-aliased edges; text is drawn on top of everything
+    return command.mesh != MESH_CIRCLE && command.mesh != MESH_TEXT;
+}
+
+void submitScene(int sceneWidth, int sceneHeight) {
+    frameCommands.clear();
+    for (const auto& layer : renderLayers) {
+        for (const auto& chunk : layer.chunks) {
+            for (const auto& command : chunk) {
+                frameCommands.push_back(&command);
+            }
+        }
+    }
+
+    // Later commands get larger z, which the projection maps nearer the viewer
+    float depthStep = 2.0f / (frameCommands.size() + 1);
+    auto depthOf = [depthStep](size_t index) { return -1.0f + depthStep * (index + 1); };
+
+    float model[16] = {
+        1.0f, 0.0f, 0.0f, 0.0f,
+        0.0f, 1.0f, 0.0f, 0.0f,
+        0.0f, 0.0f, 1.0f, 0.0f,
+        0.0f, 0.0f, 0.0f, 1.0f
+    };
+
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+
+    // Opaque geometry, front to back
+    glUseProgram(shaderProgram); // Use the shader program
+    for (size_t i = frameCommands.size(); i-- > 0;) {
+        const DrawCommand& command = *frameCommands[i];
+        if (!isOpaque(command)) {
+            continue;
+        }
+
+        const Mesh& mesh = meshes[command.mesh];
+        model[0] = command.scaleX;
+        model[5] = command.scaleY;
+        model[12] = command.x;
+        model[13] = command.y;
+        model[14] = depthOf(i);
+        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, model);
+        glUniform3f(colorLocation, command.r, command.g, command.b);
+        glBindVertexArray(mesh.vao);
+        glDrawArrays(mesh.mode, 0, mesh.count);
+    }
+
+    // Blended geometry, back to front, tested against but not written to the depth buffer
+    glDepthMask(GL_FALSE);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    for (size_t i = 0; i < frameCommands.size(); ++i) {
+        const DrawCommand& command = *frameCommands[i];
+        if (command.mesh == MESH_CIRCLE) {
+            circleInstances.insert(circleInstances.end(), { command.x, command.y, depthOf(i), command.scaleX, command.r, command.g, command.b });
+        }
+    }
+    submitCircles(sceneWidth, sceneHeight);
+    glDisable(GL_BLEND);
+    glDepthMask(GL_TRUE);
+    glDisable(GL_DEPTH_TEST);
+    glBindVertexArray(0);
+    glUseProgram(0); // Unbind the shader program
+}
+
+// HUD text over everything; uses the command sequence from submitScene
+void submitHud() {
+    for (const DrawCommand* command : frameCommands) {
+        if (command->mesh == MESH_TEXT) {
+            submitText(*command);
+        }
+    }
+}
+
+// Gameplay capture: each frame's scene target is read back, at the scene's
+// internal resolution and without the HUD, into one of a ring of pixel buffer
+// objects and only mapped once its fence has signalled, a frame or two later,
+// so the readback never stalls the GL thread. The mapped pixels go straight to
+// a background thread, which converts and writes them as a stream of binary
+// PPM images (playable with e.g. `ffmpeg -f image2pipe -c:v ppm -i capture000.ppm`)
+// and hands the buffer back to be unmapped. The GL thread never touches the
+// pixels itself, so its cost per frame does not grow with the window size.
+// A PPM stream needs every frame at one size, so when the scene size changes
+// mid-capture (e.g. the window is resized) the current file is ended and the
+// following frames go to a new one.
+enum CaptureSlotState {
+    CAPTURE_FREE,
+    CAPTURE_READING, // glReadPixels issued, waiting on the fence
+    CAPTURE_MAPPED   // mapped and owned by the encoder thread until encoded is set
+};
+
+struct CaptureSlot {
+    GLuint pbo;
+    GLsync fence;
+    int width, height;
+    CaptureSlotState state;
+    bool encoded; // guarded by captureMutex
+};
+
+struct CaptureJob {
+    int slot; // -1 ends the current capture file
+    const unsigned char* pixels; // RGBA, bottom row first
+    int width, height;
+};
+
+const int captureRingSize = 4;
+
+bool captureEnabled = false;
+CaptureSlot captureSlots[captureRingSize] = {};
+int captureSlotIndex = 0; // next slot to read into, and the oldest one in flight
+int captureFileWidth = 0, captureFileHeight = 0; // frame size of the open capture file, 0 if none
+int capturedFrames = 0;
+int droppedCaptureFrames = 0;
+int captureCalls = 0;
+float captureCostTotalMs = 0.0f;
+float captureCostMaxMs = 0.0f;
+
+std::mutex captureMutex;
+std::condition_variable captureJobReady, captureJobDone;
+std::deque<CaptureJob> captureQueue;
+bool captureEncoderStopping = false;
+std::thread captureEncoder;
+
+void writePPMFrame(FILE* file, const CaptureJob& job, vector<unsigned char>& row) {
+    fprintf(file, "P6\n%d %d\n255\n", job.width, job.height);
+    row.resize(job.width * 3);
+    for (int y = job.height - 1; y >= 0; --y) {
+        const unsigned char* src = job.pixels + (size_t)y * job.width * 4;
+        for (int x = 0; x < job.width; ++x) {
+            row[x * 3 + 0] = src[x * 4 + 0];
+            row[x * 3 + 1] = src[x * 4 + 1];
+            row[x * 3 + 2] = src[x * 4 + 2];
+        }
+        fwrite(row.data(), 1, row.size(), file);
+    }
+}
+
+void captureEncoderLoop() {
+    FILE* file = nullptr;
+    int fileIndex = 0;
+    vector<unsigned char> row;
+
+    std::unique_lock<std::mutex> lock(captureMutex);
+    for (;;) {
+        captureJobReady.wait(lock, [] { return captureEncoderStopping || !captureQueue.empty(); });
+        if (captureQueue.empty()) {
+            break; // stopping, and everything queued has been written
+        }
+        CaptureJob job = captureQueue.front();
+        captureQueue.pop_front();
+        lock.unlock();
+
+        if (job.slot < 0) {
+            if (file) {
+                fclose(file);
+                file = nullptr;
+            }
+        } else {
+            if (!file) {
+                char fileName[32];
+                snprintf(fileName, sizeof(fileName), "capture%03d.ppm", fileIndex++);
+                file = fopen(fileName, "wb");
+                if (!file) {
+                    fprintf(stderr, "Error: could not open %s for capture\n", fileName);
+                }
+            }
+            if (file) {
+                writePPMFrame(file, job, row);
+            }
+        }
+
+        lock.lock();
+        if (job.slot >= 0) {
+            captureSlots[job.slot].encoded = true;
+        }
+        captureJobDone.notify_all();
+    }
+
+    if (file) {
+        fclose(file);
+    }
+}
+
+void initCapture() {
+    for (auto& slot : captureSlots) {
+        glGenBuffers(1, &slot.pbo);
+    }
+    captureEncoder = std::thread(captureEncoderLoop);
+}
+
+void queueCaptureJob(const CaptureJob& job) {
+    std::lock_guard<std::mutex> lock(captureMutex);
+    captureQueue.push_back(job);
+    captureJobReady.notify_one();
+}
+
+// Maps a finished readback and hands the mapping to the encoder thread
+void harvestCaptureSlot(int index) {
+    CaptureSlot& slot = captureSlots[index];
+    glDeleteSync(slot.fence);
+    slot.fence = 0;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (size_t)slot.width * slot.height * 4, GL_MAP_READ_BIT);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (!pixels) {
+        slot.state = CAPTURE_FREE;
+        droppedCaptureFrames++;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(captureMutex);
+        slot.encoded = false;
+    }
+    slot.state = CAPTURE_MAPPED;
+    if (captureFileWidth != slot.width || captureFileHeight != slot.height) {
+        if (captureFileWidth > 0) {
+            queueCaptureJob({ -1, nullptr, 0, 0 }); // scene was resized; start a new file
+        }
+        captureFileWidth = slot.width;
+        captureFileHeight = slot.height;
+    }
+    queueCaptureJob({ index, (const unsigned char*)pixels, slot.width, slot.height });
+    capturedFrames++;
+}
+
+void unmapCaptureSlot(CaptureSlot& slot) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot.state = CAPTURE_FREE;
+}
+
+// Moves every slot along without blocking: hands signalled readbacks to the
+// encoder in submission order and unmaps the ones it has finished with
+void advanceCaptureSlots() {
+    bool harvesting = true;
+    for (int i = 0; i < captureRingSize; ++i) {
+        int index = (captureSlotIndex + i) % captureRingSize;
+        CaptureSlot& slot = captureSlots[index];
+        if (slot.state == CAPTURE_READING && harvesting) {
+            if (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED) {
+                harvesting = false; // later readbacks cannot have finished before this one
+                continue;
+            }
+            harvestCaptureSlot(index);
+        } else if (slot.state == CAPTURE_MAPPED) {
+            bool encoded;
+            {
+                std::lock_guard<std::mutex> lock(captureMutex);
+                encoded = slot.encoded;
+            }
+            if (encoded) {
+                unmapCaptureSlot(slot);
+            }
+        }
+    }
+}
+
+// Reads back the scene target's width x height corner once the scene pass is done
+void captureFrame(GLuint framebuffer, int width, int height) {
+    LatencyClock::time_point start = LatencyClock::now();
+    advanceCaptureSlots();
+
+    CaptureSlot& slot = captureSlots[captureSlotIndex];
+    if (slot.state != CAPTURE_FREE) {
+        droppedCaptureFrames++; // GPU or encoder is a whole ring behind; skip instead of stalling
+    } else {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        if (slot.width != width || slot.height != height) {
+            glBufferData(GL_PIXEL_PACK_BUFFER, (size_t)width * height * 4, NULL, GL_STREAM_READ);
+            slot.width = width;
+            slot.height = height;
+        }
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.state = CAPTURE_READING;
+        captureSlotIndex = (captureSlotIndex + 1) % captureRingSize;
+    }
+
+    float costMs = std::chrono::duration<float, std::milli>(LatencyClock::now() - start).count();
+    captureCalls++;
+    captureCostTotalMs += costMs;
+    captureCostMaxMs = std::max(captureCostMaxMs, costMs);
+}
+
+// Records at the render scale in effect when the capture starts; it is held
+// until the capture stops (press R first to record at full resolution)
+void startCapture() {
+    captureEnabled = true;
+    captureFileWidth = 0;
+    captureFileHeight = 0;
+    capturedFrames = 0;
+    droppedCaptureFrames = 0;
+    captureCalls = 0;
+    captureCostTotalMs = 0.0f;
+    captureCostMaxMs = 0.0f;
+    printf("Capture: on\n");
+}
+
+void stopCapture() {
+    // Drain the ring in submission order; stalling once here is fine
+    for (int i = 0; i < captureRingSize; ++i) {
+        int index = (captureSlotIndex + i) % captureRingSize;
+        if (captureSlots[index].state == CAPTURE_READING) {
+            glClientWaitSync(captureSlots[index].fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            harvestCaptureSlot(index);
+        }
+    }
+    queueCaptureJob({ -1, nullptr, 0, 0 });
+    {
+        std::unique_lock<std::mutex> lock(captureMutex);
+        captureJobDone.wait(lock, [] { return captureQueue.empty(); });
+    }
+    // The end marker was the last job, so every mapped slot has been encoded
+    for (auto& slot : captureSlots) {
+        if (slot.state == CAPTURE_MAPPED) {
+            unmapCaptureSlot(slot);
+        }
+    }
+
+    captureEnabled = false;
+    printf("Capture: off (%d frames, %d dropped, GL thread %.3f ms/frame avg, %.3f ms max)\n",
+           capturedFrames, droppedCaptureFrames,
+           captureCalls > 0 ? captureCostTotalMs / captureCalls : 0.0f, captureCostMaxMs);
+}
+
+void shutdownCapture() {
+    if (captureEnabled) {
+        stopCapture(); // finish the current file instead of leaving it truncated
+    }
+    {
+        std::lock_guard<std::mutex> lock(captureMutex);
+        captureEncoderStopping = true;
+    }
+    captureJobReady.notify_all();
+    if (captureEncoder.joinable()) {
+        captureEncoder.join();
+    }
+}
+
+// The scene is rendered into an offscreen target at a fraction of the window's
+// resolution and upscaled into a letterboxed viewport with a filtered blit.
+// The fraction follows the GPU time of the scene pass, so fill-rate-bound
+// displays trade sharpness for a steady frame rate. The HUD is drawn after
+// the blit at native resolution.
+int viewportX = 0, viewportY = 0;
+int viewportWidth = windowWidth, viewportHeight = windowHeight;
+GLuint sceneFBO, sceneColorRBO, sceneDepthRBO;
+
+bool dynamicResolutionEnabled = true;
+float renderScale = 1.0f;
+const float minRenderScale = 0.5f;
+const float targetSceneMs = 8.0f; // leaves half of a 60 Hz frame for everything else
+
+// Scene GPU time is read back a few frames late so the query never stalls
+const int gpuTimerRingSize = 3;
+GLuint gpuTimerQueries[gpuTimerRingSize];
+bool gpuTimerPending[gpuTimerRingSize] = {};
+int gpuTimerIndex = 0;
+
+void initSceneTarget() {
+    glGenFramebuffers(1, &sceneFBO);
+    glGenRenderbuffers(1, &sceneColorRBO);
+    glGenRenderbuffers(1, &sceneDepthRBO);
+    glGenQueries(gpuTimerRingSize, gpuTimerQueries);
+}
+
+// Allocates the scene target at full viewport size; lower render scales use a corner of it
+void resizeSceneTarget(int width, int height) {
+    glBindRenderbuffer(GL_RENDERBUFFER, sceneColorRBO);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, sceneDepthRBO);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, sceneColorRBO);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, sceneDepthRBO);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Error: scene framebuffer is incomplete\n");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void resizeViewport(int width, int height) {
+    // Fit the world into the window, keeping its aspect ratio
+    float scale = std::min(width / (float)windowWidth, height / (float)windowHeight);
+    viewportWidth = std::max(1, (int)(windowWidth * scale));
+    viewportHeight = std::max(1, (int)(windowHeight * scale));
+    viewportX = (width - viewportWidth) / 2;
+    viewportY = (height - viewportHeight) / 2;
+    resizeSceneTarget(viewportWidth, viewportHeight);
+}
+
+void handleReshape(int width, int height) {
+    resizeViewport(width, height);
+    glutPostRedisplay();
+}
+
+void updateRenderScale(float sceneMs) {
+    // The scale is held while capturing; every change would otherwise start a new capture file
+    if (!dynamicResolutionEnabled || captureEnabled || sceneMs <= 0.0f) {
+        return;
+    }
+    // Fill cost grows with the square of the scale; move part of the way each sample to avoid oscillating
+    float idealScale = renderScale * sqrt(targetSceneMs / sceneMs);
+    renderScale += 0.25f * (idealScale - renderScale);
+    renderScale = std::min(std::max(renderScale, minRenderScale), 1.0f);
+}
+
+void beginScenePass(int sceneWidth, int sceneHeight) {
+    int slot = gpuTimerIndex;
+    if (gpuTimerPending[slot]) {
+        GLint available = 0;
+        glGetQueryObjectiv(gpuTimerQueries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint64 elapsedNs = 0;
+            glGetQueryObjectui64v(gpuTimerQueries[slot], GL_QUERY_RESULT, &elapsedNs);
+            updateRenderScale(elapsedNs / 1.0e6f);
+        }
+    }
+    glBeginQuery(GL_TIME_ELAPSED, gpuTimerQueries[slot]);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+    glViewport(0, 0, sceneWidth, sceneHeight);
+    glEnable(GL_SCISSOR_TEST); // only clear the part of the target in use
+    glScissor(0, 0, sceneWidth, sceneHeight);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glDisable(GL_SCISSOR_TEST);
+}
+
+void endScenePass(int sceneWidth, int sceneHeight) {
+    glEndQuery(GL_TIME_ELAPSED);
+    gpuTimerPending[gpuTimerIndex] = true;
+    gpuTimerIndex = (gpuTimerIndex + 1) % gpuTimerRingSize;
+
+    // Upscale into the letterboxed viewport; the bars stay at the clear color
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFBO);
+    glBlitFramebuffer(0, 0, sceneWidth, sceneHeight,
+                      viewportX, viewportY, viewportX + viewportWidth, viewportY + viewportHeight,
+                      GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(viewportX, viewportY, viewportWidth, viewportHeight);
+}
+
+void stepSimulation() {
+    stepClamp();
+    stepSunRotation();
+    updateHousePositions();
+    updateSnowflakes(); // update snowflake positions
+}
+
+// Catches the simulation up to now. A backlog longer than maxCatchUpSteps
+// (e.g. after the window was hidden) is dropped, so the game resumes where it
+// paused instead of fast-forwarding.
+const int maxCatchUpSteps = 8;
+
+void advanceSimulation(LatencyClock::time_point now) {
+    const LatencyClock::duration step = std::chrono::milliseconds(simulationStepMs);
+    if (now - simulatedUntil > step * maxCatchUpSteps) {
+        simulatedUntil = now - step * maxCatchUpSteps;
+    }
+    while (now - simulatedUntil >= step) {
+        stepSimulation();
+        simulatedUntil += step;
+    }
+}
+
+// Posts redraws at a rate that follows the power state
+void updateFrame(int value) {
+    updatePowerState();
+    if (powerState != POWER_HIDDEN) {
+        glutPostRedisplay();
+    }
+    glutTimerFunc(timerInterval(simulationStepMs), updateFrame, 0);
+}
+
+// Headless mode (--headless): renders into an EGL pbuffer with no window and
+// no GLUT, e.g. to record a capture on a build machine without a display. The
+// simulation advances exactly one step per frame instead of following the
+// wall clock, so a run is the same length however fast the machine is.
+bool headless = false;
+
+#ifndef _WIN32
+EGLDisplay headlessDisplay = EGL_NO_DISPLAY;
+EGLSurface headlessSurface = EGL_NO_SURFACE;
+EGLContext headlessContext = EGL_NO_CONTEXT;
+
+bool initHeadlessContext() {
+    // Prefer Mesa's surfaceless platform, which needs no X or Wayland server
+    const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless") && getPlatformDisplay) {
+        headlessDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (headlessDisplay == EGL_NO_DISPLAY) {
+        headlessDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (headlessDisplay == EGL_NO_DISPLAY || !eglInitialize(headlessDisplay, NULL, NULL)) {
+        fprintf(stderr, "Error: could not initialize EGL\n");
+        return false;
+    }
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(headlessDisplay, configAttribs, &config, 1, &configCount) || configCount == 0) {
+        fprintf(stderr, "Error: no EGL config for an OpenGL pbuffer\n");
+        return false;
+    }
+
+    // The HUD uses compatibility profile calls, like the GLUT window's default context
+    const EGLint surfaceAttribs[] = { EGL_WIDTH, windowWidth, EGL_HEIGHT, windowHeight, EGL_NONE };
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+        EGL_NONE
+    };
+    eglBindAPI(EGL_OPENGL_API);
+    headlessSurface = eglCreatePbufferSurface(headlessDisplay, config, surfaceAttribs);
+    headlessContext = eglCreateContext(headlessDisplay, config, EGL_NO_CONTEXT, contextAttribs);
+    if (headlessSurface == EGL_NO_SURFACE || headlessContext == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(headlessDisplay, headlessSurface, headlessSurface, headlessContext)) {
+        fprintf(stderr, "Error: could not create an OpenGL 3.3 EGL context (0x%x)\n", eglGetError());
+        return false;
+    }
+    return true;
+}
+
+void shutdownHeadlessContext() {
+    eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(headlessDisplay, headlessContext);
+    eglDestroySurface(headlessDisplay, headlessSurface);
+    eglTerminate(headlessDisplay);
+}
+#endif
+
+void swapFrame() {
+#ifndef _WIN32
+    if (headless) {
+        eglSwapBuffers(headlessDisplay, headlessSurface);
+        return;
+    }
+#endif
     glutSwapBuffers();
 }
 
+void display() {
+    waitForQueuedFrames();
+    resolveCompletedInputs();
+
+    // Advance the simulation before the layers read it
+    advanceSimulation(headless ? simulatedUntil + std::chrono::milliseconds(simulationStepMs) : LatencyClock::now());
+
+    // Sample the clamp as late as possible; queued drops use the same position the hook is drawn at
+    hookX = lateLatchEnabled ? latchClampX() : clampX;
+    for (; queuedDrops > 0; queuedDrops--) {
+        dropHouse(hookX);
+    }
+
+    recordRenderLayers();
+
+    int sceneWidth = std::max(1, (int)(viewportWidth * renderScale));
+    int sceneHeight = std::max(1, (int)(viewportHeight * renderScale));
+    beginScenePass(sceneWidth, sceneHeight);
+    submitScene(sceneWidth, sceneHeight);
+    endScenePass(sceneWidth, sceneHeight);
+    if (!headless) {
+        submitHud(); // glutBitmapCharacter needs glutInit
+    }
+
+    if (captureEnabled) {
+        captureFrame(sceneFBO, sceneWidth, sceneHeight);
+    }
+
+    swapFrame();
+    throttleSwappedFrame();
+    timestampPendingInputs();
+    resolveCompletedInputs();
+}
+
 float zoomFactor = 1.0f;
 const float minZoomFactor = 0.5f; // Minimum zoom factor to avoid seeing the black background
 
 void updateProjection() {
-    glUseProgram(shaderProgram); // Use the shader program
     float left = 0;
     float right = windowWidth / zoomFactor;
     float bottom = 0;
@@ -631,21 +1548,43 @@ void updateProjection() {
         0.0f, 0.0f, -1.0f, 0.0f,
         -(right + left) / (right - left), -(top + bottom) / (top - bottom), 0.0f, 1.0f
     };
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, projection);
+    for (GLuint program : { shaderProgram, circleProgram }) {
+        glUseProgram(program);
+        glUniformMatrix4fv(glGetUniformLocation(program, "projection"), 1, GL_FALSE, projection);
+    }
     glUseProgram(0); // Unbind the shader program
 }
 
 void handleKeyboard(unsigned char key, int x, int y) {
+    recordInput();
     if (key == '+') {
         zoomFactor *= 1.1f;
     } else if (key == '-') {
         zoomFactor = std::max(zoomFactor * 0.9f, minZoomFactor);
+    } else if (key == 'l' || key == 'L') {
+        lateLatchEnabled = !lateLatchEnabled;
+        printf("Late latching: %s\n", lateLatchEnabled ? "on" : "off");
+    } else if (key == 't' || key == 'T') {
+        cycleFrameThrottle();
+    } else if (key == 'r' || key == 'R') {
+        dynamicResolutionEnabled = !dynamicResolutionEnabled;
+        if (!dynamicResolutionEnabled) {
+            renderScale = 1.0f;
+        }
+        printf("Dynamic resolution: %s\n", dynamicResolutionEnabled ? "on" : "off");
+    } else if (key == 'c' || key == 'C') {
+        if (captureEnabled) {
+            stopCapture();
+        } else {
+            startCapture();
+        }
     }
     updateProjection();
     glutPostRedisplay();
 }
 
 void handleMouseScroll(int button, int dir, int x, int y) {
+    recordInput();
     if (dir > 0) {
         zoomFactor *= 1.1f;
     } else {
@@ -675,6 +1614,29 @@ void checkProgramLinking(GLuint program) {
     }
 }
 
+GLuint createShaderProgram(const char* vertexShaderSource, const char* fragmentShaderSource) {
+    // Compile shaders and link program
+    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
+    glCompileShader(vertexShader);
+    checkShaderCompilation(vertexShader);
+
+    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
+    glCompileShader(fragmentShader);
+    checkShaderCompilation(fragmentShader);
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    glLinkProgram(program);
+    checkProgramLinking(program);
+
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+    return program;
+}
+
 void initShaders() {
     // Vertex shader
     const char* vertexShaderSource = R"(
@@ -698,30 +1660,82 @@ void initShaders() {
         }
     )";
 
-    // Compile shaders and link program
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-    glCompileShader(vertexShader);
-    checkShaderCompilation(vertexShader);
+    shaderProgram = createShaderProgram(vertexShaderSource, fragmentShaderSource);
+    modelLocation = glGetUniformLocation(shaderProgram, "model");
+    colorLocation = glGetUniformLocation(shaderProgram, "color");
 
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-    glCompileShader(fragmentShader);
-    checkShaderCompilation(fragmentShader);
+    // Circle vertex shader: expands the unit quad to the instance's radius plus an edge margin,
+    // converting the margin from pixels to world units with the projection and viewport scale
+    const char* circleVertexShaderSource = R"(
+        #version 330 core
+        layout(location = 0) in vec2 aCorner;
+        layout(location = 1) in vec3 aCenter;
+        layout(location = 2) in float aRadius;
+        layout(location = 3) in vec3 aColor;
+        uniform mat4 projection;
+        uniform vec2 viewportSize;
+        uniform float edgePadding;
+        out vec2 vOffset;
+        out float vRadius;
+        out vec3 vColor;
+        void main() {
+            vec2 pixelsPerUnit = abs(vec2(projection[0][0], projection[1][1])) * viewportSize * 0.5;
+            float padding = edgePadding / min(pixelsPerUnit.x, pixelsPerUnit.y);
+            vOffset = aCorner * (aRadius + padding);
+            vRadius = aRadius;
+            vColor = aColor;
+            gl_Position = projection * vec4(aCenter.xy + vOffset, aCenter.z, 1.0);
+        }
+    )";
+
+    // Circle fragment shader: coverage from the signed distance to the edge, one pixel wide
+    const char* circleFragmentShaderSource = R"(
+        #version 330 core
+        in vec2 vOffset;
+        in float vRadius;
+        in vec3 vColor;
+        out vec4 FragColor;
+        void main() {
+            float distance = length(vOffset) - vRadius;
+            float pixel = fwidth(distance);
+            float coverage = clamp(0.5 - distance / pixel, 0.0, 1.0);
+            if (coverage <= 0.0) {
+                discard;
+            }
+            FragColor = vec4(vColor, coverage);
+        }
+    )";
 
-    shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-    checkProgramLinking(shaderProgram);
+    circleProgram = createShaderProgram(circleVertexShaderSource, circleFragmentShaderSource);
+    glUseProgram(circleProgram);
+    glUniform1f(glGetUniformLocation(circleProgram, "edgePadding"), circleEdgePadding);
+    circleViewportSizeLocation = glGetUniformLocation(circleProgram, "viewportSize");
+    glUseProgram(0);
+}
 
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+void initMeshes() {
+    meshes[MESH_RECT] = { rectVAO, GL_TRIANGLE_FAN, 4 };
+    meshes[MESH_CIRCLE] = { circleVAO, GL_TRIANGLE_STRIP, 4 }; // instanced, see submitCircles
+    meshes[MESH_TRIANGLE] = { triangleVAO, GL_TRIANGLES, 3 };
+    meshes[MESH_HOOK_BODY] = { hookBodyVAO, GL_TRIANGLE_FAN, 4 };
+    meshes[MESH_BACKGROUND] = { bgVAO, GL_TRIANGLE_FAN, 4 };
+    meshes[MESH_GROUND] = { groundVAO, GL_TRIANGLE_FAN, 4 };
+}
+
+// Called by freeglut before it exits; the worker threads must not outlive the globals they wait on
+void handleClose() {
+    shutdownCapture();
+    shutdownLayerWorkers();
 }
 
 void init() {
     glewExperimental = GL_TRUE;
     GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    if (headless && err == GLEW_ERROR_NO_GLX_DISPLAY) {
+        err = GLEW_OK; // GL entry points are loaded; only the GLX extensions are missing under EGL
+    }
+#endif
     if (err != GLEW_OK) {
         fprintf(stderr, "Error: %s\n", glewGetErrorString(err));
         exit(1);
@@ -736,21 +1750,90 @@ void init() {
     initRectangleVBO(); // Initialize Rectangle VBO
     initBackgroundVBO(); // Initialize Background VBO
     initGroundVBO(); // Initialize Ground VBO
-    glutMouseWheelFunc(handleMouseScroll); // Register mouse scroll handler
-    glutTimerFunc(16, updateSunRotation, 0); // Initialize sun rotation timer
-    glutFullScreen(); // Set the screen to fullscreen mode
+    initTriangleVBO(); // Initialize Tree Triangle VBO
+    initHookBodyVBO(); // Initialize Crane Hook VBO
+    initMeshes();
+    initLayerWorkers(); // Start the layer recording threads
+    initCapture(); // Create capture PBOs and start the encoder thread
+    initSceneTarget(); // Offscreen target for the scene, sized by handleReshape
+}
+
+#ifndef _WIN32
+// Draws a fixed number of frames into a pbuffer the size of the world, then
+// shuts down the same way closing the window does
+int runHeadless(int frames, bool capture) {
+    if (!initHeadlessContext()) {
+        return 1;
+    }
+    init();
+    resizeViewport(windowWidth, windowHeight);
+    if (capture) {
+        startCapture();
+    }
+
+    LatencyClock::time_point start = LatencyClock::now();
+    for (int i = 0; i < frames; ++i) {
+        display();
+    }
+    glFinish();
+    float totalMs = std::chrono::duration<float, std::milli>(LatencyClock::now() - start).count();
+    printf("Headless: %d frames in %.1f ms (%.3f ms/frame)\n", frames, totalMs, frames > 0 ? totalMs / frames : 0.0f);
+
+    handleClose();
+    shutdownHeadlessContext();
+    return 0;
 }
+#endif
 
 int main(int argc, char ** argv) {
+    bool captureFromStart = false;
+    int headlessFrames = 300;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--capture") == 0) {
+            captureFromStart = true; // record from the first frame
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            headlessFrames = std::max(0, atoi(argv[++i]));
+        }
+    }
+    if (headless) {
+#ifndef _WIN32
+        return runHeadless(headlessFrames, captureFromStart);
+#else
+        fprintf(stderr, "Error: --headless needs EGL, which this platform does not provide\n");
+        return 1;
+#endif
+    }
+
+#ifdef _WIN32
+    // Without this Windows bitmap-scales the window on high-DPI displays and reshape never sees real pixels
+    typedef BOOL (WINAPI *SetProcessDPIAwareFunc)();
+    SetProcessDPIAwareFunc setProcessDPIAware = (SetProcessDPIAwareFunc)GetProcAddress(GetModuleHandleA("user32.dll"), "SetProcessDPIAware");
+    if (setProcessDPIAware) {
+        setProcessDPIAware();
+    }
+#endif
     glutInit(&argc, argv);
-    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
+    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB); // the scene's depth buffer lives in sceneFBO
     glutInitWindowSize(windowWidth, windowHeight);
     glutCreateWindow("Building Stacking Game");
     init();
+    glutMouseWheelFunc(handleMouseScroll); // Register mouse scroll handler
+    glutFullScreen(); // Set the screen to fullscreen mode
+    if (captureFromStart) {
+        startCapture();
+    }
     glutDisplayFunc(display);
+    glutReshapeFunc(handleReshape);
+    glutCloseFunc(handleClose);
     glutKeyboardFunc(handleKeyboard);
     glutMouseFunc(mouseClick);
-    glutTimerFunc(16, updateClamp, 0);
+    glutMotionFunc(handleMouseMotion);
+    glutPassiveMotionFunc(handleMouseMotion);
+    glutWindowStatusFunc(handleWindowStatus); // pause while minimized or covered
+    glutEntryFunc(handleEntry); // lower the redraw rate while the pointer is elsewhere
+    glutTimerFunc(simulationStepMs, updateFrame, 0);
     glutMainLoop();
     return 0;
 }